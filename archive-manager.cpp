@@ -1,11 +1,240 @@
 #include "archive-manager.hpp"
 #include <boost/filesystem.hpp>
-#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
 #include <fcntl.h>  //open()
+#include <unistd.h> //pread()
+#if defined(__x86_64__)
+#include <nmmintrin.h> //_mm_crc32_*()
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h> //__crc32c*()
+#endif
 
 //debug
 #include <iostream>
 
+///////////////////////////////////////////
+// Entry Checksums
+///////////////////////////////////////////
+namespace
+{
+	// The CRC32C of every entry is stored as an extended attribute, which the pax writer records in the entry's extended header.
+	// Its value is "<size>:<mtime seconds>.<mtime nanoseconds>:<crc32c>". Extractors restore the attribute onto the extracted file,
+	// so when that file is edited and archived again by another tool the stale checksum comes along with it.
+	// The size and mtime tie the checksum to the entry it was computed for, so such a stale value is ignored instead of reported as corruption.
+	const char *const CHECKSUM_XATTR = "user.archive-manager.crc32c";
+
+	// Software fallback: slicing-by-8 over the reflected Castagnoli polynomial
+	struct crc32c_table
+	{
+		uint32_t t[8][256];
+		crc32c_table()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t crc = i;
+				for (int k = 0; k < 8; k++)
+				{
+					crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+				}
+				t[0][i] = crc;
+			}
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				for (int k = 1; k < 8; k++)
+				{
+					t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+				}
+			}
+		}
+	};
+
+	uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+	{
+		static const crc32c_table table;
+		const auto &t = table.t;
+		while (len >= 8)
+		{
+			uint32_t lo, hi;
+			std::memcpy(&lo, p, 4);
+			std::memcpy(&hi, p + 4, 4);
+			lo ^= crc;
+			crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+				  t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+			p += 8;
+			len -= 8;
+		}
+		while (len--)
+		{
+			crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+		}
+		return crc;
+	}
+
+#if defined(__x86_64__)
+	__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+	{
+		uint64_t crc64 = crc;
+		while (len >= 8)
+		{
+			uint64_t word;
+			std::memcpy(&word, p, 8);
+			crc64 = _mm_crc32_u64(crc64, word);
+			p += 8;
+			len -= 8;
+		}
+		crc = static_cast<uint32_t>(crc64);
+		while (len--)
+		{
+			crc = _mm_crc32_u8(crc, *p++);
+		}
+		return crc;
+	}
+	bool crc32c_detect_hw()
+	{
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse4.2");
+	}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+	{
+		while (len >= 8)
+		{
+			uint64_t word;
+			std::memcpy(&word, p, 8);
+			crc = __crc32cd(crc, word);
+			p += 8;
+			len -= 8;
+		}
+		while (len--)
+		{
+			crc = __crc32cb(crc, *p++);
+		}
+		return crc;
+	}
+	bool crc32c_detect_hw()
+	{
+		return true;
+	}
+#else
+	uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+	{
+		return crc32c_sw(crc, p, len);
+	}
+	bool crc32c_detect_hw()
+	{
+		return false;
+	}
+#endif
+
+	/**
+	 * @brief Extends the CRC32C crc (0 for an empty input) with len bytes of data. Uses the CPU's crc32 instruction when available.
+	 */
+	uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+	{
+		static const bool has_hw = crc32c_detect_hw();
+		const uint8_t *p = static_cast<const uint8_t *>(data);
+		crc = ~crc;
+		crc = has_hw ? crc32c_hw(crc, p, len) : crc32c_sw(crc, p, len);
+		return ~crc;
+	}
+
+	/**
+	 * @brief Accumulates the checksum of an entry from the blocks returned by archive_read_data_block().
+	 * Holes between the blocks of sparse entries are checksummed as the zeros they are extracted as.
+	 */
+	class entry_checksum
+	{
+	public:
+		void update(const void *buff, size_t size, int64_t offset)
+		{
+			this->skip_to(offset);
+			this->m_crc = crc32c(this->m_crc, buff, size);
+			this->m_position = offset + size;
+		}
+
+		uint32_t finish(int64_t entry_size)
+		{
+			this->skip_to(entry_size);
+			return this->m_crc;
+		}
+	private:
+		uint32_t m_crc{0};
+		int64_t m_position{0};
+
+		void skip_to(int64_t offset)
+		{
+			static const uint8_t zeros[4096] = {};
+			while (this->m_position < offset)
+			{
+				size_t len = static_cast<size_t>(std::min<int64_t>(sizeof(zeros), offset - this->m_position));
+				this->m_crc = crc32c(this->m_crc, zeros, len);
+				this->m_position += len;
+			}
+		}
+	};
+
+	void store_checksum(archive_entry *entry, uint32_t checksum)
+	{
+		char value[64];
+		int len = std::snprintf(value, sizeof(value), "%lld:%lld.%09ld:%08x", static_cast<long long>(archive_entry_size(entry)),
+			static_cast<long long>(archive_entry_mtime(entry)), archive_entry_mtime_nsec(entry), checksum);
+		archive_entry_xattr_add_entry(entry, CHECKSUM_XATTR, value, len);
+	}
+
+	/**
+	 * @brief Looks up the checksum stored in the extended attributes of an entry
+	 * 
+	 * @return true if the entry has a well formed checksum that was computed for this entry (same size and mtime)
+	 * @return false otherwise
+	 */
+	bool load_checksum(archive_entry *entry, uint32_t &checksum)
+	{
+		const char *name;
+		const void *value;
+		size_t size;
+		archive_entry_xattr_reset(entry);
+		while (archive_entry_xattr_next(entry, &name, &value, &size) == ARCHIVE_OK)
+		{
+			if (std::strcmp(name, CHECKSUM_XATTR) != 0)
+			{
+				continue;
+			}
+			std::string text(static_cast<const char *>(value), size);
+			char *end;
+			long long entry_size = std::strtoll(text.c_str(), &end, 10);
+			if (*end != ':' || entry_size != archive_entry_size(entry))
+			{
+				return false;
+			}
+			long long mtime = std::strtoll(end + 1, &end, 10);
+			if (*end != '.' || mtime != archive_entry_mtime(entry))
+			{
+				return false;
+			}
+			long mtime_nsec = std::strtol(end + 1, &end, 10);
+			if (*end != ':' || mtime_nsec != archive_entry_mtime_nsec(entry))
+			{
+				return false;
+			}
+			const char *hex = end + 1;
+			unsigned long parsed = std::strtoul(hex, &end, 16);
+			if (end - hex != 8 || *end != '\0')
+			{
+				return false;
+			}
+			checksum = static_cast<uint32_t>(parsed);
+			return true;
+		}
+		return false;
+	}
+}
+
 ///////////////////////////////////////////
 // Public Class Functions
 ///////////////////////////////////////////
@@ -118,7 +347,10 @@ bool archiveManager::add_folder(const std::string &source_dir)
 				//					file_path = /path/to/source_dir/dir1/dir2/file2
 				//					relative_file_path = dir1/dir2/file2
 				this->create_new_entry(it->path().string(), relative_file_path.string());
-				this->write_entry_to_archive(it->path().string());
+				if (!this->write_entry_to_archive(it->path().string()))
+				{
+					success = false;
+				}
 				archive_entry_free(entry);
 			}
 
@@ -183,7 +415,10 @@ bool archiveManager::add_entry(const std::vector<std::string> &file_names)
 		{
 			boost::filesystem::path file_path(fname);
 			this->create_new_entry(file_path.string(), file_path.filename().string());
-			this->write_entry_to_archive(fname);
+			if (!this->write_entry_to_archive(fname))
+			{
+				success = false;
+			}
 			archive_entry_free(entry);
 		}
 		else
@@ -195,7 +430,7 @@ bool archiveManager::add_entry(const std::vector<std::string> &file_names)
 	return success;	
 }
 
-bool archiveManager::extract_entries(std::string &target_dir, const std::vector<std::string> *file_names)
+bool archiveManager::extract_entries(std::string &target_dir, const std::vector<std::string> *file_names, bool verify)
 {
 	std::cout<<std::endl<<"...Extract Files from Archive..."<<std::endl;
 	bool success = true;
@@ -227,7 +462,10 @@ bool archiveManager::extract_entries(std::string &target_dir, const std::vector<
 			std::string entry_target_path = target_dir+entry_source_path;
 			archive_entry_set_pathname(this->entry, entry_target_path.c_str());
 			std::cout<<"Extracting File: "<<entry_source_path<<" -> "<<entry_target_path<<std::endl;
-			this->write_entry_to_disk(disk);
+			if (!this->write_entry_to_disk(disk, verify))
+			{
+				success = false;
+			}
 		}
 		else
 		{
@@ -249,37 +487,36 @@ bool archiveManager::extract_entries(std::string &target_dir, const std::vector<
 	return success;
 }
 
-std::vector<uint8_t> archiveManager::get_entry(const std::string &entry_path)
+std::vector<uint8_t> archiveManager::get_entry(const std::string &entry_path, bool verify)
 {
 	std::cout<<"...Read Entry from Archive..."<<std::endl;
-	bool success = true;
-	const void *buff;
-	size_t size;
-	int64_t offset;
 	if (!this->m_archive_is_open)
 	{
 		std::cout<<"Archive not open..."<<std::endl;
 		return {};
 	}
-	
 
 	//First let's try to find the entry. If it exists, the header will be at the correct spot in the archive.
 	if(this->entry_exists(entry_path))
 	{
-		std::string entry_source_path(archive_entry_pathname(this->entry));		
-		std::cout<<"entry SP: "<<entry_source_path<<std::endl;
-		this->entry_exists(entry_path);
-
 		const void *buff;
 		size_t size;
 		int64_t offset;
+		std::vector<uint8_t> data;
+		entry_checksum checksum;
 		int ret = archive_read_data_block(this->read_arch, &buff, &size, &offset);
-		std::ostringstream temp;
 		while (ret != ARCHIVE_EOF && ret == ARCHIVE_OK) 
-		{	
-			std::cout<<"temp prev = "<<temp.str()<<std::endl;
-			temp<<reinterpret_cast<char *>(const_cast<void *>(buff));
-			std::cout<<"buff = "<<reinterpret_cast<char *>(const_cast<void *>(buff))<<" temp = "<<temp.str()<<" size = "<<size<<std::endl;
+		{
+			//Blocks are placed at their offset, so the holes of sparse entries are left as zeros
+			if (static_cast<size_t>(offset) + size > data.size())
+			{
+				data.resize(offset + size);
+			}
+			std::memcpy(data.data() + offset, buff, size);
+			if (verify)
+			{
+				checksum.update(buff, size, offset);
+			}
 			ret = archive_read_data_block(this->read_arch, &buff, &size, &offset);
 		}
 		if (ret != ARCHIVE_OK && ret != ARCHIVE_EOF) 
@@ -287,27 +524,180 @@ std::vector<uint8_t> archiveManager::get_entry(const std::string &entry_path)
 			std::cerr<<archive_error_string(this->read_arch)<<std::endl;
 			return {};
 		}
+		if (archive_entry_size(this->entry) > static_cast<int64_t>(data.size()))
+		{
+			data.resize(archive_entry_size(this->entry));
+		}
 
-		std::istringstream temp2(temp.str());
-
-		temp2.seekg(0, std::ios::end);
-		auto data_size = temp2.tellg();
-		std::cout<<data_size<<std::endl;
-		temp2.seekg(0, std::ios::beg);
-		std::vector<uint8_t> data(data_size);
-		if (temp2.read(reinterpret_cast<char *>(data.data()), data_size))
+		uint32_t expected;
+		if (verify && !load_checksum(this->entry, expected))
 		{
-			std::cout<<"OK?"<<std::endl;
-			return data;
+			std::cout<<"No valid checksum stored for: "<<entry_path<<std::endl;
 		}
-		else
+		else if (verify && checksum.finish(archive_entry_size(this->entry)) != expected)
 		{
+			std::cerr<<"Checksum mismatch: "<<entry_path<<std::endl;
 			return {};
 		}
+		return data;
 	}
 	return {};
 }
 
+bool archiveManager::verify()
+{
+	std::cout<<std::endl<<"...Verify Archive..."<<std::endl;
+	//In read-write mode the writer may still hold blocks that have not reached the disk yet
+	if (!this->m_archive_is_open || !this->m_readonly)
+	{
+		std::cout<<"Archive not open or not open on read-only mode..."<<std::endl;
+		return false;
+	}
+	bool success = true;
+	size_t unverified = 0;
+	size_t verified = 0;
+
+	//An entry whose data can be checksummed straight from the archive file
+	struct verify_job
+	{
+		std::string path;
+		int64_t offset;
+		int64_t size;
+		uint32_t expected;
+	};
+	std::vector<verify_job> jobs;
+
+	//Use a separate reader, so that read_arch is left untouched
+	struct archive *temp_arch;
+	struct archive_entry *temp_entry;
+	int fd = open(this->m_archive_path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		std::cerr<<"Could not open: "<<this->m_archive_path<<std::endl;
+		return false;
+	}
+	temp_arch = archive_read_new();
+	archive_read_support_filter_all(temp_arch);
+	archive_read_support_format_all(temp_arch);
+	if (archive_read_open_fd(temp_arch, fd, 10240))
+	{
+		std::cerr<<archive_error_string(temp_arch)<<std::endl;
+		archive_read_free(temp_arch);
+		close(fd);
+		return false;
+	}
+
+	//First pass: walk the headers. The data of uncompressed entries is skipped (lseek) and queued for the thread pool.
+	//Compressed archives can only be decoded sequentially, so their entries are checksummed here while they are decoded.
+	int ret = archive_read_next_header(temp_arch, &temp_entry);
+	while (ret == ARCHIVE_OK)
+	{
+		std::string entry_path(archive_entry_pathname(temp_entry));
+		uint32_t expected;
+		if (archive_entry_filetype(temp_entry) != AE_IFREG)
+		{
+			//Nothing to checksum
+		}
+		else if (!load_checksum(temp_entry, expected))
+		{
+			std::cout<<"No valid checksum stored for: "<<entry_path<<std::endl;
+			unverified++;
+		}
+		else if (archive_filter_code(temp_arch, 0) == ARCHIVE_FILTER_NONE && archive_entry_sparse_count(temp_entry) == 0)
+		{
+			//Without a filter, the data of the entry lies right after its header. 
+			//archive_filter_bytes() is the position of the reader in the archive file, which is just past the header.
+			jobs.push_back({entry_path, archive_filter_bytes(temp_arch, 0), archive_entry_size(temp_entry), expected});
+		}
+		else
+		{
+			const void *buff;
+			size_t size;
+			int64_t offset;
+			entry_checksum checksum;
+			int data_ret = archive_read_data_block(temp_arch, &buff, &size, &offset);
+			while (data_ret == ARCHIVE_OK)
+			{
+				checksum.update(buff, size, offset);
+				data_ret = archive_read_data_block(temp_arch, &buff, &size, &offset);
+			}
+			if (data_ret != ARCHIVE_EOF)
+			{
+				std::cerr<<entry_path<<": "<<archive_error_string(temp_arch)<<std::endl;
+				success = false;
+			}
+			else if (checksum.finish(archive_entry_size(temp_entry)) != expected)
+			{
+				std::cerr<<"Checksum mismatch: "<<entry_path<<std::endl;
+				success = false;
+			}
+			verified++;
+		}
+		ret = archive_read_next_header(temp_arch, &temp_entry);
+	}
+	if (ret != ARCHIVE_EOF)
+	{
+		std::cerr<<archive_error_string(temp_arch)<<std::endl;
+		success = false;
+	}
+	archive_read_close(temp_arch);
+	archive_read_free(temp_arch);
+
+	//Second pass: the queued entries are independent of each other, so they are checksummed by one thread per core, using pread() on the shared descriptor
+	std::atomic<size_t> next_job{0};
+	std::atomic<bool> jobs_ok{true};
+	std::mutex report_mutex;
+	auto worker = [&]()
+	{
+		std::vector<uint8_t> buff(1 << 20);
+		for (size_t i = next_job++; i < jobs.size(); i = next_job++)
+		{
+			const verify_job &job = jobs[i];
+			uint32_t checksum = 0;
+			int64_t done = 0;
+			while (done < job.size)
+			{
+				size_t chunk = static_cast<size_t>(std::min<int64_t>(buff.size(), job.size - done));
+				ssize_t len = pread(fd, buff.data(), chunk, job.offset + done);
+				if (len <= 0)
+				{
+					break;
+				}
+				checksum = crc32c(checksum, buff.data(), len);
+				done += len;
+			}
+			if (done != job.size || checksum != job.expected)
+			{
+				std::lock_guard<std::mutex> lock(report_mutex);
+				std::cerr<<(done != job.size ? "Short read: " : "Checksum mismatch: ")<<job.path<<std::endl;
+				jobs_ok = false;
+			}
+		}
+	};
+	size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), jobs.size());
+	std::vector<std::thread> pool;
+	for (size_t i = 0; i < thread_count; i++)
+	{
+		pool.emplace_back(worker);
+	}
+	for (std::thread &t : pool)
+	{
+		t.join();
+	}
+	close(fd);
+	verified += jobs.size();
+	success = success && jobs_ok;
+
+	//An archive in which nothing could be checked has not been verified
+	if (verified == 0 && unverified > 0)
+	{
+		success = false;
+	}
+
+	std::cout<<"Verified "<<verified<<" entries ("<<unverified<<" without checksum): "<<(success ? "OK" : "FAILED")<<std::endl;
+	return success;
+}
+
 
 bool archiveManager::close_archive()
 {
@@ -359,15 +749,24 @@ void archiveManager::create_new_entry(const std::string &disk_file_path, const s
 	archive_entry_set_size(this->entry, st.st_size); // Note 3
 	archive_entry_set_filetype(this->entry, AE_IFREG);
 	archive_entry_set_perm(this->entry, 0644);
+	//The stored checksum is tied to the size and mtime of the entry
+	archive_entry_set_mtime(this->entry, st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
 }
 
 
-bool archiveManager::write_entry_to_disk(archive *disk)
+bool archiveManager::write_entry_to_disk(archive *disk, bool verify)
 {
 	bool success = true;
 	const void *buff;
 	size_t size;
 	int64_t offset;
+	entry_checksum checksum;
+	uint32_t expected;
+	if (verify && !load_checksum(this->entry, expected))
+	{
+		std::cout<<"No valid checksum stored for: "<<archive_entry_pathname(this->entry)<<std::endl;
+		verify = false;
+	}
 
 	int ret = archive_write_header(disk, this->entry);
 	if (ret != ARCHIVE_OK) 
@@ -380,6 +779,10 @@ bool archiveManager::write_entry_to_disk(archive *disk)
 		ret = archive_read_data_block(this->read_arch, &buff, &size, &offset);
 		while (ret != ARCHIVE_EOF && ret == ARCHIVE_OK) 
 		{	
+			if (verify)
+			{
+				checksum.update(buff, size, offset);
+			}
 			ret = archive_write_data_block(disk, buff, size, offset);
 			if (ret != ARCHIVE_OK) 
 			{
@@ -394,6 +797,11 @@ bool archiveManager::write_entry_to_disk(archive *disk)
 			success = false;
 			std::cerr<<archive_error_string(this->read_arch)<<std::endl;
 		}
+		else if (ret == ARCHIVE_EOF && verify && checksum.finish(archive_entry_size(this->entry)) != expected)
+		{
+			success = false;
+			std::cerr<<"Checksum mismatch: "<<archive_entry_pathname(this->entry)<<std::endl;
+		}
 	}
 	return success;
 }
@@ -402,8 +810,32 @@ bool archiveManager::write_entry_to_archive(const std::string &absolute_file_pat
 {
 	bool success = true;
 	char buff[10240];
-	int len;
-	int fd;
+	ssize_t len;
+	int64_t total = 0;
+	uint32_t checksum = 0;
+	int fd = open(absolute_file_path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		std::cerr<<"Could not open: "<<absolute_file_path<<std::endl;
+		return false;
+	}
+
+	//The checksum goes in the header, which precedes the data, so the file has to be read once before we start writing
+	len = read(fd, buff, sizeof(buff));
+	while ( len > 0 ) 
+	{
+		checksum = crc32c(checksum, buff, len);
+		total += len;
+		len = read(fd, buff, sizeof(buff));
+	}
+	if (len < 0 || total != archive_entry_size(this->entry))
+	{
+		std::cerr<<"Could not read: "<<absolute_file_path<<" (read "<<total<<" of "<<archive_entry_size(this->entry)<<" bytes)"<<std::endl;
+		close(fd);
+		return false;
+	}
+	store_checksum(this->entry, checksum);
+
 	int ret = archive_write_header(this->write_arch, this->entry);
 	std::cout<<"Writing :"<<absolute_file_path<<" -> "<< archive_entry_pathname(this->entry)<<std::endl;
 	if (ret < ARCHIVE_OK) 
@@ -413,16 +845,42 @@ bool archiveManager::write_entry_to_archive(const std::string &absolute_file_pat
 	}
 	if (ret > ARCHIVE_FAILED) 
 	{
-		fd = open(absolute_file_path.c_str(), O_RDONLY);
+		//Stream the data, making sure it is still the data that was checksummed. 
+		//If the file shrank, libarchive pads the entry to the size in the header, which verify() will then report.
+		uint32_t streamed_checksum = 0;
+		bool write_failed = false;
+		bool file_grew = false;
+		total = 0;
+		lseek(fd, 0, SEEK_SET);
 		len = read(fd, buff, sizeof(buff));
-		
 		while ( len > 0 ) 
 		{
-			archive_write_data(this->write_arch, buff, len);
+			la_ssize_t written = archive_write_data(this->write_arch, buff, len);
+			if (written < 0)
+			{
+				const char *error = archive_error_string(this->write_arch);
+				std::cerr<<(error ? error : "Could not write to the archive")<<std::endl;
+				success = false;
+				write_failed = true;
+				break;
+			}
+			if (written < len)
+			{
+				//The file grew past the size in the header, libarchive only takes what fits in the entry
+				file_grew = true;
+				break;
+			}
+			streamed_checksum = crc32c(streamed_checksum, buff, len);
+			total += len;
 			len = read(fd, buff, sizeof(buff));
 		}
-		close(fd);
+		if (!write_failed && (file_grew || len < 0 || total != archive_entry_size(this->entry) || streamed_checksum != checksum))
+		{
+			std::cerr<<absolute_file_path<<" could not be read or changed while being archived"<<std::endl;
+			success = false;
+		}
 	}
+	close(fd);
 	return success;
 }
 
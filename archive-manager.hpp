@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <cstdint>
 #include <archive.h>
 #include <archive_entry.h>
 /**
@@ -9,6 +10,15 @@
  * 2. Check if an entry exists to an archive
  * 3. Add files to an already existing archive
  * 4. Extract all or specific files from an already existing archive
+ * 5. Verify the integrity of the entries of an already existing archive
+ *
+ * Every entry written by this class carries a CRC32C checksum of its contents, stored as the extended attribute "user.archive-manager.crc32c"
+ * in the entry's pax header, together with the size and mtime of the entry. Note that:
+ * - GNU tar prints "Ignoring unknown extended header keyword" for each entry when listing or extracting such archives.
+ * - libarchive based extractors (e.g. bsdtar) restore the attribute onto the extracted files by default, and GNU tar does with --xattrs.
+ *   Re-archiving those files with such tools carries the (possibly stale) attribute into the new archive.
+ * A checksum is therefore only trusted when it matches the size and mtime of its entry, i.e. for archives written by this class;
+ * anything else is treated as an entry without a checksum.
  */
 class archiveManager
 {
@@ -59,18 +69,30 @@ public:
 	 * 
 	 * @param target_dir The absolute path of the target directory to extract the files
 	 * @param file_names (Optional argument). If a list of file names is provided, only those files will be extracted from the archive
-	 * @return true if the files are extracted successfully
+	 * @param verify (Optional argument). If true, the checksum of each extracted entry is checked while it is being written to the disk
+	 * @return true if the files are extracted successfully (and, if requested, their checksums matched)
 	 * @return false otherwise
 	 */
-	bool extract_entries(std::string &target_dir, const std::vector<std::string>* entries_path = nullptr);
+	bool extract_entries(std::string &target_dir, const std::vector<std::string>* entries_path = nullptr, bool verify = false);
 
 	/**
 	 * @brief Returns the data contained in an archive entry
 	 * 
 	 * @param entry_path path of the entry in the archive
+	 * @param verify (Optional argument). If true, the checksum of the entry is checked and an empty vector is returned on mismatch
 	 * @return std::vector<uint8_t> vector of bytes that represent the data in the entry
 	 */
-	std::vector<uint8_t> get_entry(const std::string &entry_path);
+	std::vector<uint8_t> get_entry(const std::string &entry_path, bool verify = false);
+
+	/**
+	 * @brief Checks the stored checksum of every entry in the archive against its contents. Requires opening an archive first in read-only mode.
+	 * 	For uncompressed archives the entries are checked in parallel, using one thread per core.
+	 * 	Entries without a valid checksum are reported, and cause a failure only if no entry at all could be checked.
+	 * 
+	 * @return true if every checksummed entry matched and at least one entry was checked (or the archive has no entries without a checksum)
+	 * @return false otherwise
+	 */
+	bool verify();
 
 	/**
 	 * @brief Close the opened archive
@@ -107,13 +129,16 @@ private:
 	 * @brief Writes whatever the struct write_arch is pointing to, in whatever the struct disk is pointing to. 
 	 * This functions is called only when extracting an archive to the disk. 
 	 * 
+	 * @param verify whether the checksum of the entry should be checked while writing it
 	 * @return true if the archive entry was written to disk successfully
 	 * @return false otherwise
 	 */
-    bool write_entry_to_disk(archive *disk);
+    bool write_entry_to_disk(archive *disk, bool verify);
 
 	/**
-	 * @brief Writes the data in absolute_file_path in the archive targeted by write_arch. The archive entry is defined from the entry struct
+	 * @brief Writes the data in absolute_file_path in the archive targeted by write_arch. The archive entry is defined from the entry struct.
+	 * The file is read twice: once to compute the checksum that goes in the entry header, and once while streaming it to the archive,
+	 * so that a file that changed in between (or a short read) is reported instead of silently archived.
 	 * 
 	 * @param absolute_file_path the absolute path of the file we want to add to the archive
 	 * @return true if the file was added to the archive